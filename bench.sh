@@ -0,0 +1,39 @@
+#!/bin/sh
+# Benchmarks mergestudents over generated inputs and prints one JSON document.
+# Usage: ./bench.sh [size ...]   (defaults to 10000 100000 1000000 students per input)
+# Generator settings can be overridden through SEED, DUPLICATES, SORTED, NAMES and DEPARTMENTS.
+set -e
+
+SIZES=${*:-"10000 100000 1000000"}
+SEED=${SEED:-1}
+DUPLICATES=${DUPLICATES:-0.01}
+SORTED=${SORTED:-0.0}
+NAMES=${NAMES:-1000}
+DEPARTMENTS=${DEPARTMENTS:-20}
+CC=${CC:-cc}
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+$CC -O2 -o "$WORK/genstudents" genstudents.c
+$CC -O2 -pthread -o "$WORK/mergestudents" mergestudents.c -lm
+
+printf '{"commit": "%s", "seed": %s, "duplicates": %s, "sorted": %s, "names": %s, "departments": %s, "runs": [' \
+    "$(git rev-parse --short HEAD 2>/dev/null || echo unknown)" "$SEED" "$DUPLICATES" "$SORTED" "$NAMES" "$DEPARTMENTS"
+
+SEPARATOR=""
+
+for SIZE in $SIZES; do
+    # Each input gets its own seed so the two files differ
+    for INPUT in 1 2; do
+        "$WORK/genstudents" --count "$SIZE" --seed "$((SEED * 2 + INPUT))" --duplicates "$DUPLICATES" \
+            --sorted "$SORTED" --names "$NAMES" --departments "$DEPARTMENTS" "$WORK/input$INPUT.txt"
+    done
+
+    printf '%s\n  {"size": %s, "result": %s}' "$SEPARATOR" "$SIZE" \
+        "$("$WORK/mergestudents" --bench "$WORK/input1.txt" "$WORK/input2.txt" "$WORK/output.txt")"
+
+    SEPARATOR=","
+done
+
+printf '\n]}\n'
@@ -0,0 +1,140 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+/* TYPEDEF */
+
+typedef char * String;
+
+typedef struct Options {
+    unsigned long count;
+    uint64_t seed;
+    // Chance that a student reuses an id already generated
+    double duplicate_rate;
+    // 1 writes ids in ascending order, 0 fully shuffles them
+    double sorted;
+    unsigned int names;
+    unsigned int departments;
+} Options;
+
+/* RANDOM */
+
+// xorshift64*, so a seed gives the same file on every platform
+uint64_t next_random(uint64_t * state){
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+
+    return *state * 2685821657736338717ULL;
+}
+
+// Uniform in [0, 1)
+double next_double(uint64_t * state){
+    return (next_random(state) >> 11) / 9007199254740992.0;
+}
+
+/* GENERATOR */
+
+int compare_ids(const void * a, const void * b){
+    unsigned int id_1 = *(const unsigned int *) a;
+    unsigned int id_2 = *(const unsigned int *) b;
+
+    return (id_1 > id_2) - (id_1 < id_2);
+}
+
+void generate(String file_name, Options * options){
+    FILE * file = fopen(file_name, "w");
+    unsigned int * ids = malloc(options->count * sizeof(unsigned int));
+    uint64_t state = options->seed * 0x9E3779B97F4A7C15ULL + 1;
+    unsigned int id = 0;
+
+    // xorshift would be stuck at zero
+    if (state == 0){
+        state = 1;
+    }
+
+    if (file == NULL){
+        printf("ERROR: Couldn't open %s for writing\n", file_name);
+        exit(-1);
+    }
+
+    if (ids == NULL && options->count > 0){
+        printf("ERROR: Couldn't allocate memory for %lu ids\n", options->count);
+        exit(-1);
+    }
+
+    // Ids with small gaps; duplicates repeat an earlier id
+    for (unsigned long i = 0; i < options->count; i++){
+        if (i > 0 && next_double(&state) < options->duplicate_rate){
+            ids[i] = ids[next_random(&state) % i];
+        } else {
+            id += 1 + next_random(&state) % 3;
+            ids[i] = id;
+        }
+    }
+
+    qsort(ids, options->count, sizeof(unsigned int), compare_ids);
+
+    // Fisher-Yates that leaves each position alone with probability sorted
+    for (unsigned long i = options->count; i > 1; i--){
+        if (next_double(&state) >= options->sorted){
+            unsigned long j = next_random(&state) % i;
+            unsigned int swap = ids[i - 1];
+
+            ids[i - 1] = ids[j];
+            ids[j] = swap;
+        }
+    }
+
+    for (unsigned long i = 0; i < options->count; i++){
+        fprintf(file, "%u First%u Last%u Dept%u %.2f\n",
+            ids[i],
+            (unsigned int) (next_random(&state) % options->names),
+            (unsigned int) (next_random(&state) % options->names),
+            (unsigned int) (next_random(&state) % options->departments),
+            next_double(&state) * 4);
+    }
+
+    free(ids);
+    fclose(file);
+}
+
+/* MAIN */
+
+int main(int argc, String argv[]){
+    Options options = { .count = 1000, .seed = 1, .duplicate_rate = 0, .sorted = 0, .names = 1000, .departments = 20 };
+    int arg = 1;
+
+    // Options come in pairs before the file name
+    while (arg + 1 < argc && strncmp(argv[arg], "--", 2) == 0){
+        if (strcmp(argv[arg], "--count") == 0){
+            options.count = strtoul(argv[arg + 1], NULL, 10);
+        } else if (strcmp(argv[arg], "--seed") == 0){
+            options.seed = strtoull(argv[arg + 1], NULL, 10);
+        } else if (strcmp(argv[arg], "--duplicates") == 0){
+            options.duplicate_rate = strtod(argv[arg + 1], NULL);
+        } else if (strcmp(argv[arg], "--sorted") == 0){
+            options.sorted = strtod(argv[arg + 1], NULL);
+        } else if (strcmp(argv[arg], "--names") == 0){
+            options.names = strtoul(argv[arg + 1], NULL, 10);
+        } else if (strcmp(argv[arg], "--departments") == 0){
+            options.departments = strtoul(argv[arg + 1], NULL, 10);
+        } else {
+            printf("Unknown option %s\n", argv[arg]);
+            return -1;
+        }
+
+        arg += 2;
+    }
+
+    if (argc - arg != 1 || options.names == 0 || options.departments == 0){
+        printf("Follow format: ./genstudents [--count 1000] [--seed 1] [--duplicates 0.0] [--sorted 0.0] "
+               "[--names 1000] [--departments 20] output.txt\n");
+        return -1;
+    }
+
+    generate(argv[arg], &options);
+
+    return 0;
+}
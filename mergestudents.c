@@ -1,6 +1,20 @@
+#define _GNU_SOURCE
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/resource.h>
 
 /* TYPEDEF */
 
@@ -12,6 +26,8 @@ typedef struct Student {
     String last_name;
     String department;
     float gpa;
+    // Only assigned when the merge interns departments
+    unsigned int department_id;
 } Student;
 
 typedef struct Node {
@@ -25,6 +41,165 @@ typedef struct List {
     Node * tail;
 } List;
 
+// Number of nodes handed from the merger to the writer at once
+#define BATCH_SIZE 1024
+
+// Number of batches that can be waiting on the writer before the merger blocks
+#define QUEUE_CAPACITY 64
+
+// Lists are never split into chunks smaller than this for sorting
+#define MIN_CHUNK_SIZE 4096
+
+// Index and summary files sit next to the roster they describe, e.g. output.txt.idx
+#define INDEX_SUFFIX ".idx"
+#define STATS_SUFFIX ".stats"
+#define INDEX_MAGIC 0x5849534d
+
+// Binary rosters start with this magic in place of the first text record
+#define ROSTER_MAGIC 0x4253534d
+
+// Delta mode samples one id per block of the master roster
+#define SPARSE_BLOCK_SIZE 65536
+
+// Bytes read per sample before looking for the block's first record
+#define SPARSE_PROBE_SIZE 512
+
+// One GPA bucket per hundredth of a point from 0.00 to 5.00, plus one bucket
+// before them for every lower GPA and one after them for every higher GPA
+#define GPA_MAX_HUNDREDTHS 500
+#define GPA_BUCKETS (GPA_MAX_HUNDREDTHS + 3)
+
+// Gives each distinct string a dense id and keeps a single copy of it
+typedef struct Interner {
+    // NUL terminated strings back to back
+    char * strings;
+    uint64_t size;
+    uint64_t capacity;
+    // Offset of each string in strings, indexed by id
+    uint32_t * offsets;
+    unsigned int count;
+    unsigned int offsets_capacity;
+    // Open addressing table of id + 1, 0 when the slot is empty
+    unsigned int * slots;
+    unsigned int slot_count;
+} Interner;
+
+typedef struct Aggregate {
+    unsigned long count;
+    double gpa_sum;
+    float gpa_min;
+    float gpa_max;
+} Aggregate;
+
+// Accumulators indexed by department id
+typedef struct Aggregates {
+    Aggregate * entries;
+    unsigned int capacity;
+} Aggregates;
+
+typedef struct IndexEntry {
+    uint32_t id;
+    uint32_t department_id;
+    uint32_t bucket;
+    uint64_t offset;
+} IndexEntry;
+
+typedef struct Index {
+    IndexEntry * entries;
+    uint32_t count;
+    uint32_t capacity;
+    // Byte offset just past the last record written
+    uint64_t end;
+} Index;
+
+// On-disk layout of an index file; every section is a byte offset from the start of the file
+typedef struct IndexHeader {
+    uint32_t magic;
+    uint32_t record_count;
+    uint32_t department_count;
+    uint32_t bucket_count;
+    // uint64_t[record_count + 1], byte offset of each record in id order, then the roster's size
+    uint64_t offsets;
+    // uint32_t[record_count], ids in roster order
+    uint64_t ids;
+    // uint32_t[record_count + 1] each, ids in Eytzinger order and their roster position; slot 0 unused
+    uint64_t eytzinger;
+    uint64_t eytzinger_ranks;
+    // IndexDepartment[department_count], sorted by name
+    uint64_t departments;
+    // uint32_t[record_count], roster positions grouped by department
+    uint64_t department_postings;
+    // uint32_t[bucket_count + 1], first posting of each GPA bucket
+    uint64_t buckets;
+    // uint32_t[record_count], roster positions grouped by GPA bucket
+    uint64_t bucket_postings;
+    // NUL terminated department names
+    uint64_t names;
+} IndexHeader;
+
+typedef struct IndexDepartment {
+    uint32_t name;
+    uint32_t first;
+    uint32_t count;
+} IndexDepartment;
+
+// On-disk layout of a binary roster: header, records sorted by id, then the string table
+typedef struct RosterHeader {
+    uint32_t magic;
+    uint32_t reserved;
+    uint64_t record_count;
+    // Byte offset and size of the string table
+    uint64_t strings;
+    uint64_t strings_size;
+} RosterHeader;
+
+// Names are byte offsets of NUL terminated strings in the string table
+typedef struct RosterRecord {
+    uint32_t id;
+    float gpa;
+    uint32_t first_name;
+    uint32_t last_name;
+    uint32_t department;
+} RosterRecord;
+
+typedef struct Roster {
+    RosterHeader * header;
+    size_t size;
+    RosterRecord * records;
+    char * strings;
+} Roster;
+
+typedef struct SparseIndex {
+    unsigned int * ids;
+    uint64_t * offsets;
+    unsigned int count;
+} SparseIndex;
+
+// Buffered reader over a text roster, used to parse records at arbitrary offsets
+typedef struct Scanner {
+    int fd;
+    uint64_t size;
+    uint64_t start;
+    size_t length;
+    char buffer[SPARSE_BLOCK_SIZE + 1];
+} Scanner;
+
+typedef struct Batch {
+    // Shallow copies; names point into lists or mapped rosters that outlive the batch
+    Student students[BATCH_SIZE];
+    int size;
+} Batch;
+
+typedef struct Queue {
+    Batch * batches[QUEUE_CAPACITY];
+    int head;
+    int size;
+    int closed;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+} Queue;
+
 /* LINKED LIST FUNCTIONS */
 
 Node * create_node(unsigned int id, String firstname, String lastname, String department, float gpa){
@@ -58,14 +233,6 @@ Node * create_node(unsigned int id, String firstname, String lastname, String de
     return node;
 }
 
-Node * copy(Node * node){
-    return create_node(node->student->id,  
-                       node->student->first_name,
-                       node->student->last_name,
-                       node->student->department,
-                       node->student->gpa);
-}
-
 List * create_list(){
     List * list = malloc(sizeof(List));
     
@@ -80,20 +247,24 @@ List * create_list(){
     return list;
 }
 
+void destroy_node(Node * node){
+    // Free node's student
+    free(node->student->first_name);
+    free(node->student->last_name);
+    free(node->student->department);
+    free(node->student);
+
+    free(node);
+}
+
 void destroy_list(List * list){    
     Node * node = list->head;
 
     while (node != NULL){
-        // Free node's student
-        free(node->student->first_name);
-        free(node->student->last_name);
-        free(node->student->department);
-        free(node->student);
-        
         Node * old_node = node;
         node = node->next;
 
-        free(old_node);
+        destroy_node(old_node);
     }
 
     free(list);
@@ -117,24 +288,14 @@ void add_to(List * list, Node * node){
     }
 }
 
-Node * find_greater_in(List * list, int id){
-    if (list != NULL){
-        Node * node = list->head;
-
-        while (node != NULL){
-            if (node->student->id > id){
-                return node;
-            }
-
-            node = node->next;
-        }
-
-        // Return NULL if id not found
-        return NULL;
-    } else {
-        printf("ERROR: Attempted find_greater_in with empty list\n");
-        exit(-1);
-    }
+// Returns the number of bytes written
+int write_student(FILE * file, Student * student){
+    return fprintf(file, "%d;%s;%s;%s;%.2f\n",
+        student->id,
+        student->first_name,
+        student->last_name,
+        student->department,
+        student->gpa);
 }
 
 void print(List * list){
@@ -154,7 +315,136 @@ void print(List * list){
 
 /* I/O FUNCTIONS */
 
-List * read(String file_name){
+// Returns 1 if file_name is a binary roster rather than text
+int is_roster(String file_name){
+    uint32_t magic = 0;
+    FILE * file = fopen(file_name, "r");
+
+    if (file != NULL){
+        if (fread(&magic, sizeof(magic), 1, file) != 1){
+            magic = 0;
+        }
+
+        fclose(file);
+    }
+
+    return magic == ROSTER_MAGIC;
+}
+
+// Maps a binary roster so its records can be searched in place
+Roster open_roster(String file_name){
+    Roster roster;
+    struct stat info;
+    int fd = open(file_name, O_RDONLY);
+
+    if (fd < 0 || fstat(fd, &info) != 0){
+        printf("ERROR: File not found. %s does not exist\n", file_name);
+        exit(-1);
+    }
+
+    roster.size = info.st_size;
+    roster.header = mmap(NULL, roster.size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (roster.header == MAP_FAILED || roster.size < sizeof(RosterHeader) || roster.header->magic != ROSTER_MAGIC){
+        printf("ERROR: %s is not a valid binary roster\n", file_name);
+        exit(-1);
+    }
+
+    RosterHeader * header = roster.header;
+
+    roster.records = (RosterRecord *) (header + 1);
+    roster.strings = (char *) header + header->strings;
+
+    // Divide rather than multiply so a huge record count can't overflow past the check
+    if (header->strings < sizeof(RosterHeader) || header->strings > roster.size
+        || header->record_count > (header->strings - sizeof(RosterHeader)) / sizeof(RosterRecord)
+        || header->strings_size > roster.size - header->strings
+        || (header->strings_size > 0 && roster.strings[header->strings_size - 1] != '\0')){
+        printf("ERROR: %s is not a valid binary roster\n", file_name);
+        exit(-1);
+    }
+
+    return roster;
+}
+
+void close_roster(Roster * roster){
+    munmap(roster->header, roster->size);
+}
+
+// Returns 1 if the records are in id order, so the roster can be merged where it is mapped
+int roster_is_sorted(Roster * roster){
+    for (uint64_t i = 1; i < roster->header->record_count; i++){
+        if (roster->records[i - 1].id > roster->records[i].id){
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+// Index of the first record with an id >= id, or the record count if there is none
+uint64_t find_in_roster(Roster * roster, unsigned int id){
+    uint64_t low = 0;
+    uint64_t high = roster->header->record_count;
+
+    while (low < high){
+        uint64_t middle = low + (high - low) / 2;
+
+        if (roster->records[middle].id < id){
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    return low;
+}
+
+// Returns the string at offset in the string table; the table is known to end in a NUL
+String roster_string(Roster * roster, uint32_t offset){
+    if (offset >= roster->header->strings_size){
+        printf("ERROR: Binary roster has a name outside its string table\n");
+        exit(-1);
+    }
+
+    return roster->strings + offset;
+}
+
+int write_record(FILE * file, Roster * roster, RosterRecord * record){
+    return fprintf(file, "%d;%s;%s;%s;%.2f\n",
+        record->id,
+        roster_string(roster, record->first_name),
+        roster_string(roster, record->last_name),
+        roster_string(roster, record->department),
+        record->gpa);
+}
+
+List * read_roster(String file_name){
+    Roster roster = open_roster(file_name);
+    List * list = create_list();
+
+    for (uint64_t i = 0; i < roster.header->record_count; i++){
+        RosterRecord * record = &roster.records[i];
+
+        add_to(list, create_node(record->id,
+                                 roster_string(&roster, record->first_name),
+                                 roster_string(&roster, record->last_name),
+                                 roster_string(&roster, record->department),
+                                 record->gpa));
+    }
+
+    close_roster(&roster);
+
+    return list;
+}
+
+// Reads either a binary roster or whitespace separated text
+List * read_from(String file_name){
+    if (is_roster(file_name)){
+        return read_roster(file_name);
+    }
+
     FILE * file = fopen(file_name, "r");
     
     if (file != NULL){
@@ -184,161 +474,1755 @@ List * read(String file_name){
     }
 }
 
-void write_to(String file_name, List * list){
-    FILE * file = fopen(file_name, "w+");
+/* QUEUE FUNCTIONS */
 
-    if (list != NULL){
-        Node * node = list->head;
-        
-        while (node != NULL){
-            fprintf(file, "%d;%s;%s;%s;%.2f\n",
-                node->student->id,
-                node->student->first_name,
-                node->student->last_name,
-                node->student->department,
-                node->student->gpa);
+Queue * create_queue(){
+    Queue * queue = malloc(sizeof(Queue));
 
-            node = node->next;
-        }
+    if (queue != NULL){
+        queue->head = 0;
+        queue->size = 0;
+        queue->closed = 0;
 
-        fclose(file);
+        pthread_mutex_init(&queue->lock, NULL);
+        pthread_cond_init(&queue->not_empty, NULL);
+        pthread_cond_init(&queue->not_full, NULL);
+    } else {
+        printf("ERROR: Couldn't allocate memory for queue\n");
+        exit(-1);
+    }
+
+    return queue;
+}
+
+void destroy_queue(Queue * queue){
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->not_empty);
+    pthread_cond_destroy(&queue->not_full);
+
+    free(queue);
+}
+
+Batch * create_batch(){
+    Batch * batch = malloc(sizeof(Batch));
+
+    if (batch != NULL){
+        batch->size = 0;
     } else {
-        printf("ERROR: Couldn't write_to file; passed list was null\n");
+        printf("ERROR: Couldn't allocate memory for batch\n");
+        exit(-1);
+    }
+
+    return batch;
+}
+
+// Blocks while the queue is full
+void push_to(Queue * queue, Batch * batch){
+    pthread_mutex_lock(&queue->lock);
+
+    while (queue->size == QUEUE_CAPACITY){
+        pthread_cond_wait(&queue->not_full, &queue->lock);
+    }
+
+    queue->batches[(queue->head + queue->size) % QUEUE_CAPACITY] = batch;
+    queue->size++;
+
+    pthread_cond_signal(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+// Blocks while the queue is empty; returns NULL once it is closed and drained
+Batch * pop_from(Queue * queue){
+    Batch * batch = NULL;
+
+    pthread_mutex_lock(&queue->lock);
+
+    while (queue->size == 0 && !queue->closed){
+        pthread_cond_wait(&queue->not_empty, &queue->lock);
+    }
+
+    if (queue->size > 0){
+        batch = queue->batches[queue->head];
+        queue->head = (queue->head + 1) % QUEUE_CAPACITY;
+        queue->size--;
+
+        pthread_cond_signal(&queue->not_full);
+    }
+
+    pthread_mutex_unlock(&queue->lock);
+
+    return batch;
+}
+
+void close_queue(Queue * queue){
+    pthread_mutex_lock(&queue->lock);
+
+    queue->closed = 1;
+
+    pthread_cond_broadcast(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+/* THREADS */
+
+// Exits like a failed malloc does, so no caller joins a thread that never started
+void start_thread(pthread_t * thread, void * (* worker)(void *), void * arg){
+    if (pthread_create(thread, NULL, worker, arg) != 0){
+        printf("ERROR: Couldn't create thread\n");
         exit(-1);
     }
 }
 
 /* SORTING */
 
-// Insertion sort
-void sort(List * list){
+typedef struct SortTask {
+    pthread_t thread;
+    Node * chain;
+    Node * other;
+} SortTask;
+
+// Merges two sorted chains linked through next; ties keep chain_1's nodes first
+Node * merge_chains(Node * chain_1, Node * chain_2){
+    Node head;
+    Node * tail = &head;
+
+    while (chain_1 != NULL && chain_2 != NULL){
+        if (chain_1->student->id <= chain_2->student->id){
+            tail->next = chain_1;
+            chain_1 = chain_1->next;
+        } else {
+            tail->next = chain_2;
+            chain_2 = chain_2->next;
+        }
+
+        tail = tail->next;
+    }
+
+    tail->next = (chain_1 != NULL) ? chain_1 : chain_2;
+
+    return head.next;
+}
+
+// Bottom-up merge sort of a chain linked through next
+Node * sort_chain(Node * chain){
+    // bins[i] holds a sorted run of 2^i nodes, older nodes in higher bins
+    Node * bins[64] = { NULL };
+    Node * sorted = NULL;
+    int i;
+
+    while (chain != NULL){
+        Node * run = chain;
+        chain = chain->next;
+        run->next = NULL;
+
+        for (i = 0; bins[i] != NULL; i++){
+            run = merge_chains(bins[i], run);
+            bins[i] = NULL;
+        }
+
+        bins[i] = run;
+    }
+
+    for (i = 0; i < 64; i++){
+        if (bins[i] != NULL){
+            sorted = merge_chains(bins[i], sorted);
+        }
+    }
+
+    return sorted;
+}
+
+void * sort_worker(void * arg){
+    SortTask * task = arg;
+
+    task->chain = sort_chain(task->chain);
+
+    return NULL;
+}
+
+void * merge_chains_worker(void * arg){
+    SortTask * task = arg;
+
+    task->chain = merge_chains(task->chain, task->other);
+
+    return NULL;
+}
+
+// Parallel merge sort: chunks are sorted on up to max_threads threads, then merged pairwise
+void sort(List * list, int max_threads){
     if (list != NULL){
-        // Split the list into two parts...
-        // ...an unsorted list, starting at the 2nd element...
-        Node * unsorted_head = list->head->next;
-        // ...and a sorted list, starting at the 1st element
-        Node * sorted_tail = list->head;
-        // Break sorted_tail->next since it should eventually be the tail
-        sorted_tail->next = NULL;
-
-        while (unsorted_head != NULL){
-            Node * curr_node = unsorted_head;
-
-            // Get next node
-            unsorted_head = unsorted_head->next;
-
-            if (curr_node->student->id < list->head->student->id){
-                // Make curr_node the list->head
-                curr_node->prev = NULL;
-                curr_node->next = list->head;
-                list->head->prev = curr_node;
-                list->head = curr_node;
-            } else if (curr_node->student->id > sorted_tail->student->id){
-                // Make curr_node the sorted_tail
-                curr_node->next = NULL;
-                curr_node->prev = sorted_tail;
-                sorted_tail->next = curr_node;
-                sorted_tail = curr_node;
-            } else {
-                // Search for where to put the node
-                Node * greater_node = find_greater_in(list, curr_node->student->id);
-
-                // Insert in front of found node
-                curr_node->next = greater_node;
-                curr_node->prev = greater_node->prev;
-                greater_node->prev->next = curr_node;
-                greater_node->prev = curr_node;
+        unsigned long count = 0;
+        int sorted = 1;
+        Node * node;
+
+        for (node = list->head; node != NULL; node = node->next){
+            if (node->next != NULL && node->student->id > node->next->student->id){
+                sorted = 0;
+            }
+
+            count++;
+        }
+
+        // Binary rosters and other presorted inputs need no work
+        if (count < 2 || sorted){
+            return;
+        }
+
+        int threads = count / MIN_CHUNK_SIZE;
+
+        if (threads > max_threads){
+            threads = max_threads;
+        }
+
+        if (threads < 1){
+            threads = 1;
+        }
+
+        SortTask * tasks = malloc(threads * sizeof(SortTask));
+
+        if (tasks == NULL){
+            printf("ERROR: Couldn't allocate memory for sort tasks\n");
+            exit(-1);
+        }
+
+        // Cut the list into one chain per thread
+        node = list->head;
+
+        for (int i = 0; i < threads; i++){
+            unsigned long chunk = count / threads + ((unsigned long) i < count % threads ? 1 : 0);
+
+            tasks[i].chain = node;
+
+            for (unsigned long j = 1; j < chunk; j++){
+                node = node->next;
+            }
+
+            Node * next = node->next;
+            node->next = NULL;
+            node = next;
+        }
+
+        // Sort each chain
+        for (int i = 1; i < threads; i++){
+            start_thread(&tasks[i].thread, sort_worker, &tasks[i]);
+        }
+
+        sort_worker(&tasks[0]);
+
+        for (int i = 1; i < threads; i++){
+            pthread_join(tasks[i].thread, NULL);
+        }
+
+        // Merge neighbouring chains until one is left in tasks[0]
+        for (int width = 1; width < threads; width *= 2){
+            for (int i = 0; i + width < threads; i += 2 * width){
+                tasks[i].other = tasks[i + width].chain;
+                start_thread(&tasks[i].thread, merge_chains_worker, &tasks[i]);
+            }
+
+            for (int i = 0; i + width < threads; i += 2 * width){
+                pthread_join(tasks[i].thread, NULL);
             }
         }
+
+        // Restore prev links and the tail
+        list->head = tasks[0].chain;
+        list->head->prev = NULL;
+
+        for (node = list->head; node->next != NULL; node = node->next){
+            node->next->prev = node;
+        }
+
+        list->tail = node;
+
+        free(tasks);
     } else {
         printf("ERROR: Couldn't sort NULL list\n");
         exit(-1);
     }
 }
 
-List * merge(List * list_1, List * list_2){
-    if (list_1 != NULL && list_2 != NULL){
-        // List that will contain the merged items
-        List * merged_list = create_list();
+/* INTERNING */
 
-        // Node to be inserted into the merged list
-        Node * new_node;
+Interner * create_interner(){
+    Interner * interner = malloc(sizeof(Interner));
 
-        // Starting place for both lists
-        Node * node_1 = list_1->head;
-        Node * node_2 = list_2->head;
-        
-        // Increment through both nodes
-        while (node_1 != NULL && node_2 != NULL){
-            if (node_1->student->id < node_2->student->id){
-                // List 1 had smaller node
-                new_node = copy(node_1);
-                node_1 = node_1->next;
-            } else {
-                // List 2 had smaller node
-                new_node = copy(node_2);
-                node_2 = node_2->next;
-            }
+    if (interner != NULL){
+        interner->size = 0;
+        interner->capacity = 1 << 12;
+        interner->count = 0;
+        interner->offsets_capacity = 64;
+        interner->slot_count = 128;
+        interner->strings = malloc(interner->capacity);
+        interner->offsets = malloc(interner->offsets_capacity * sizeof(uint32_t));
+        interner->slots = calloc(interner->slot_count, sizeof(unsigned int));
 
-            add_to(merged_list, new_node);
+        if (interner->strings == NULL || interner->offsets == NULL || interner->slots == NULL){
+            printf("ERROR: Couldn't allocate memory for interner tables\n");
+            exit(-1);
         }
+    } else {
+        printf("ERROR: Couldn't allocate memory for interner\n");
+        exit(-1);
+    }
+
+    return interner;
+}
+
+void destroy_interner(Interner * interner){
+    free(interner->strings);
+    free(interner->offsets);
+    free(interner->slots);
+    free(interner);
+}
+
+// Returns the string with the given id; only valid until the next intern
+String interned(Interner * interner, unsigned int id){
+    return interner->strings + interner->offsets[id];
+}
+
+// FNV-1a
+unsigned int hash(String name){
+    unsigned int result = 2166136261u;
+
+    while (*name != '\0'){
+        result = (result ^ (unsigned char) *name++) * 16777619u;
+    }
+
+    return result;
+}
 
-        // If list_1 isn't empty, but list_2 is
-        while (node_1 != NULL){
-            new_node = copy(node_1);
-            add_to(merged_list, new_node);
-            node_1 = node_1->next;
+// Doubles the slot table once it is half full
+void grow_interner(Interner * interner){
+    unsigned int slot_count = interner->slot_count * 2;
+    unsigned int * slots = calloc(slot_count, sizeof(unsigned int));
+
+    if (slots == NULL){
+        printf("ERROR: Couldn't allocate memory for interner slots\n");
+        exit(-1);
+    }
+
+    for (unsigned int id = 0; id < interner->count; id++){
+        unsigned int slot = hash(interned(interner, id)) & (slot_count - 1);
+
+        while (slots[slot] != 0){
+            slot = (slot + 1) & (slot_count - 1);
         }
 
-        // If list_2 isn't empty, but list_1 is
-        while (node_2 != NULL){
-            new_node = copy(node_2);
-            add_to(merged_list, new_node);
-            node_2 = node_2->next;
+        slots[slot] = id + 1;
+    }
+
+    free(interner->slots);
+    interner->slots = slots;
+    interner->slot_count = slot_count;
+}
+
+// Returns the id of string, copying it in and assigning the next free id the first time it is seen
+unsigned int intern(Interner * interner, String string){
+    unsigned int slot = hash(string) & (interner->slot_count - 1);
+
+    while (interner->slots[slot] != 0){
+        unsigned int id = interner->slots[slot] - 1;
+
+        if (strcmp(interned(interner, id), string) == 0){
+            return id;
         }
 
-        return merged_list;
-    } else {
-        printf("ERROR: Can't merge lists; one or both was NULL\n");
+        slot = (slot + 1) & (interner->slot_count - 1);
+    }
+
+    size_t length = strlen(string) + 1;
+
+    // Offsets are stored as 32 bits, here and in binary rosters
+    if (interner->size + length > UINT32_MAX){
+        printf("ERROR: Interned strings are over 4 GiB\n");
         exit(-1);
     }
-}
 
-/* MAIN */
+    while (interner->size + length > interner->capacity){
+        interner->capacity *= 2;
+        interner->strings = realloc(interner->strings, interner->capacity);
 
-int main(int argc, String argv[]){
-    int rc = 0;
-    
-    if (argc == 4){
-        // Get file names from command line arguments
-        String input_file_1 = strdup(argv[1]);
-        String input_file_2 = strdup(argv[2]);
-        String output_file = strdup(argv[3]);
+        if (interner->strings == NULL){
+            printf("ERROR: Couldn't allocate memory for interned strings\n");
+            exit(-1);
+        }
+    }
 
-        // Create lists from files
-        List * list_1 = read(input_file_1);
-        free(input_file_1);
-        
-        List * list_2 = read(input_file_2);
-        free(input_file_2);
+    if (interner->count == interner->offsets_capacity){
+        interner->offsets_capacity *= 2;
+        interner->offsets = realloc(interner->offsets, interner->offsets_capacity * sizeof(uint32_t));
 
-        // Insertion sort lists
-        sort(list_1);      
-        sort(list_2);
+        if (interner->offsets == NULL){
+            printf("ERROR: Couldn't allocate memory for interned string offsets\n");
+            exit(-1);
+        }
+    }
 
-        // Merge lists together
-        List * list_out = merge(list_1, list_2);
+    unsigned int id = interner->count++;
 
-        // Output final list to file
-        write_to(output_file, list_out);
-        free(output_file);
+    memcpy(interner->strings + interner->size, string, length);
+    interner->offsets[id] = interner->size;
+    interner->size += length;
+    interner->slots[slot] = id + 1;
 
-        // Free memory
-        destroy_list(list_1);
-        destroy_list(list_2);
-        destroy_list(list_out);
+    if (interner->count * 2 > interner->slot_count){
+        grow_interner(interner);
+    }
+
+    return id;
+}
+
+/* AGGREGATES */
+
+Aggregates * create_aggregates(){
+    Aggregates * aggregates = malloc(sizeof(Aggregates));
+
+    if (aggregates != NULL){
+        aggregates->capacity = 64;
+        aggregates->entries = calloc(aggregates->capacity, sizeof(Aggregate));
+
+        if (aggregates->entries == NULL){
+            printf("ERROR: Couldn't allocate memory for aggregate entries\n");
+            exit(-1);
+        }
+    } else {
+        printf("ERROR: Couldn't allocate memory for aggregates\n");
+        exit(-1);
+    }
+
+    return aggregates;
+}
+
+void destroy_aggregates(Aggregates * aggregates){
+    free(aggregates->entries);
+    free(aggregates);
+}
+
+void add_to_aggregate(Aggregates * aggregates, unsigned int department_id, float gpa){
+    if (department_id >= aggregates->capacity){
+        unsigned int capacity = aggregates->capacity;
+
+        while (department_id >= capacity){
+            capacity *= 2;
+        }
+
+        aggregates->entries = realloc(aggregates->entries, capacity * sizeof(Aggregate));
+
+        if (aggregates->entries == NULL){
+            printf("ERROR: Couldn't allocate memory for aggregate entries\n");
+            exit(-1);
+        }
+
+        memset(aggregates->entries + aggregates->capacity, 0, (capacity - aggregates->capacity) * sizeof(Aggregate));
+        aggregates->capacity = capacity;
+    }
+
+    Aggregate * aggregate = &aggregates->entries[department_id];
+
+    if (aggregate->count == 0 || gpa < aggregate->gpa_min){
+        aggregate->gpa_min = gpa;
+    }
+
+    if (aggregate->count == 0 || gpa > aggregate->gpa_max){
+        aggregate->gpa_max = gpa;
+    }
+
+    aggregate->count++;
+    aggregate->gpa_sum += gpa;
+}
+
+// Used by qsort_r to order department ids by name
+int compare_departments(const void * a, const void * b, void * departments){
+    return strcmp(interned(departments, *(const uint32_t *) a),
+                  interned(departments, *(const uint32_t *) b));
+}
+
+// Writes department;headcount;average;min;max lines ordered by department name
+void write_aggregates(String file_name, Aggregates * aggregates, Interner * departments){
+    FILE * file = fopen(file_name, "w");
+
+    if (file != NULL){
+        uint32_t * order = malloc(departments->count * sizeof(uint32_t));
+
+        if (order == NULL && departments->count > 0){
+            printf("ERROR: Couldn't allocate memory for department order\n");
+            exit(-1);
+        }
+
+        for (uint32_t id = 0; id < departments->count; id++){
+            order[id] = id;
+        }
+
+        qsort_r(order, departments->count, sizeof(uint32_t), compare_departments, departments);
+
+        for (uint32_t i = 0; i < departments->count; i++){
+            Aggregate * aggregate = &aggregates->entries[order[i]];
+
+            fprintf(file, "%s;%lu;%.2f;%.2f;%.2f\n",
+                interned(departments, order[i]),
+                aggregate->count,
+                aggregate->gpa_sum / aggregate->count,
+                aggregate->gpa_min,
+                aggregate->gpa_max);
+        }
+
+        free(order);
+        fclose(file);
+    } else {
+        printf("ERROR: Couldn't open %s for writing\n", file_name);
+        exit(-1);
+    }
+}
+
+/* INDEX */
+
+Index * create_index(){
+    Index * index = malloc(sizeof(Index));
+
+    if (index != NULL){
+        index->count = 0;
+        index->capacity = 1024;
+        index->end = 0;
+        index->entries = malloc(index->capacity * sizeof(IndexEntry));
+
+        if (index->entries == NULL){
+            printf("ERROR: Couldn't allocate memory for index entries\n");
+            exit(-1);
+        }
+    } else {
+        printf("ERROR: Couldn't allocate memory for index\n");
+        exit(-1);
+    }
+
+    return index;
+}
+
+void destroy_index(Index * index){
+    free(index->entries);
+    free(index);
+}
+
+// Rounds exactly like the %.2f the roster is written with: a float times 100 is exact in a double,
+// so rint's round-half-even matches printf
+uint32_t gpa_bucket(float gpa){
+    double hundredths = rint((double) gpa * 100);
+
+    if (hundredths > GPA_MAX_HUNDREDTHS){
+        return GPA_BUCKETS - 1;
+    } else if (!(hundredths >= 0)){
+        // Below 0.00, or not a number
+        return 0;
+    }
+
+    return hundredths + 1;
+}
+
+// Records a student that was just written length bytes long at the end of the roster
+void add_entry(Index * index, Student * student, int length){
+    if (index->count == index->capacity){
+        index->capacity *= 2;
+        index->entries = realloc(index->entries, index->capacity * sizeof(IndexEntry));
+
+        if (index->entries == NULL){
+            printf("ERROR: Couldn't allocate memory for index entries\n");
+            exit(-1);
+        }
+    }
+
+    IndexEntry * entry = &index->entries[index->count++];
+
+    entry->id = student->id;
+    entry->department_id = student->department_id;
+    entry->bucket = gpa_bucket(student->gpa);
+    entry->offset = index->end;
+
+    index->end += length;
+}
+
+String file_name_with(String file_name, String suffix){
+    String result = malloc(strlen(file_name) + strlen(suffix) + 1);
+
+    if (result == NULL){
+        printf("ERROR: Couldn't allocate memory for file name\n");
+        exit(-1);
+    }
+
+    strcpy(result, file_name);
+    strcat(result, suffix);
+
+    return result;
+}
+
+// Lays out ids[] in Eytzinger order starting at slot k; returns the next unused roster position
+uint32_t fill_eytzinger(uint32_t * ids, uint32_t * eytzinger, uint32_t * ranks, uint32_t count, uint32_t rank, uint32_t k){
+    if (k <= count){
+        rank = fill_eytzinger(ids, eytzinger, ranks, count, rank, 2 * k);
+
+        eytzinger[k] = ids[rank];
+        ranks[k] = rank;
+        rank++;
+
+        rank = fill_eytzinger(ids, eytzinger, ranks, count, rank, 2 * k + 1);
+    }
+
+    return rank;
+}
+
+// Groups roster positions by key into postings; starts[key] is where each key's run begins
+void fill_postings(uint32_t * postings, uint32_t * starts, uint32_t key_count, Index * index, int by_department){
+    uint32_t * next = calloc(key_count + 1, sizeof(uint32_t));
+
+    if (next == NULL){
+        printf("ERROR: Couldn't allocate memory for postings\n");
+        exit(-1);
+    }
+
+    for (uint32_t i = 0; i < index->count; i++){
+        next[(by_department ? index->entries[i].department_id : index->entries[i].bucket) + 1]++;
+    }
+
+    for (uint32_t key = 0; key < key_count; key++){
+        next[key + 1] += next[key];
+    }
+
+    memcpy(starts, next, (key_count + 1) * sizeof(uint32_t));
+
+    for (uint32_t i = 0; i < index->count; i++){
+        postings[next[by_department ? index->entries[i].department_id : index->entries[i].bucket]++] = i;
+    }
+
+    free(next);
+}
+
+void write_index(String file_name, Index * index, Interner * departments){
+    uint32_t count = index->count;
+    IndexHeader header = { .magic = INDEX_MAGIC, .record_count = count,
+                           .department_count = departments->count, .bucket_count = GPA_BUCKETS };
+
+    uint64_t * offsets = malloc((count + 1) * sizeof(uint64_t));
+    uint32_t * ids = malloc(count * sizeof(uint32_t));
+    uint32_t * eytzinger = malloc((count + 1) * sizeof(uint32_t));
+    uint32_t * ranks = malloc((count + 1) * sizeof(uint32_t));
+    uint32_t * department_postings = malloc(count * sizeof(uint32_t));
+    uint32_t * department_starts = malloc((departments->count + 1) * sizeof(uint32_t));
+    uint32_t * order = malloc(departments->count * sizeof(uint32_t));
+    IndexDepartment * table = malloc(departments->count * sizeof(IndexDepartment));
+    uint32_t * bucket_postings = malloc(count * sizeof(uint32_t));
+    uint32_t * bucket_starts = malloc((GPA_BUCKETS + 1) * sizeof(uint32_t));
+
+    if (offsets == NULL || ids == NULL || eytzinger == NULL || ranks == NULL
+        || department_postings == NULL || department_starts == NULL || (order == NULL && departments->count > 0)
+        || (table == NULL && departments->count > 0) || bucket_postings == NULL || bucket_starts == NULL){
+        printf("ERROR: Couldn't allocate memory for index file\n");
+        exit(-1);
+    }
+
+    for (uint32_t i = 0; i < count; i++){
+        offsets[i] = index->entries[i].offset;
+        ids[i] = index->entries[i].id;
+    }
+
+    offsets[count] = index->end;
+    eytzinger[0] = 0;
+    ranks[0] = count;
+
+    fill_eytzinger(ids, eytzinger, ranks, count, 0, 1);
+    fill_postings(department_postings, department_starts, departments->count, index, 1);
+    fill_postings(bucket_postings, bucket_starts, GPA_BUCKETS, index, 0);
+
+    // Department table sorted by name so queries can binary search it
+    for (uint32_t id = 0; id < departments->count; id++){
+        order[id] = id;
+    }
+
+    qsort_r(order, departments->count, sizeof(uint32_t), compare_departments, departments);
+
+    uint32_t names_size = 0;
+
+    for (uint32_t i = 0; i < departments->count; i++){
+        table[i].name = names_size;
+        table[i].first = department_starts[order[i]];
+        table[i].count = department_starts[order[i] + 1] - department_starts[order[i]];
+
+        names_size += strlen(interned(departments, order[i])) + 1;
+    }
+
+    // The 8 byte section goes first so every section stays aligned
+    header.offsets = sizeof(IndexHeader);
+    header.ids = header.offsets + (count + 1) * sizeof(uint64_t);
+    header.eytzinger = header.ids + count * sizeof(uint32_t);
+    header.eytzinger_ranks = header.eytzinger + (count + 1) * sizeof(uint32_t);
+    header.departments = header.eytzinger_ranks + (count + 1) * sizeof(uint32_t);
+    header.department_postings = header.departments + departments->count * sizeof(IndexDepartment);
+    header.buckets = header.department_postings + count * sizeof(uint32_t);
+    header.bucket_postings = header.buckets + (GPA_BUCKETS + 1) * sizeof(uint32_t);
+    header.names = header.bucket_postings + count * sizeof(uint32_t);
+
+    FILE * file = fopen(file_name, "w");
+
+    if (file != NULL){
+        fwrite(&header, sizeof(IndexHeader), 1, file);
+        fwrite(offsets, sizeof(uint64_t), count + 1, file);
+        fwrite(ids, sizeof(uint32_t), count, file);
+        fwrite(eytzinger, sizeof(uint32_t), count + 1, file);
+        fwrite(ranks, sizeof(uint32_t), count + 1, file);
+        fwrite(table, sizeof(IndexDepartment), departments->count, file);
+        fwrite(department_postings, sizeof(uint32_t), count, file);
+        fwrite(bucket_starts, sizeof(uint32_t), GPA_BUCKETS + 1, file);
+        fwrite(bucket_postings, sizeof(uint32_t), count, file);
+
+        for (uint32_t i = 0; i < departments->count; i++){
+            fwrite(interned(departments, order[i]), 1, strlen(interned(departments, order[i])) + 1, file);
+        }
+
+        if (ferror(file)){
+            printf("ERROR: Couldn't write index file %s\n", file_name);
+            exit(-1);
+        }
+
+        fclose(file);
+    } else {
+        printf("ERROR: Couldn't open %s for writing\n", file_name);
+        exit(-1);
+    }
+
+    free(offsets);
+    free(ids);
+    free(eytzinger);
+    free(ranks);
+    free(department_postings);
+    free(department_starts);
+    free(order);
+    free(table);
+    free(bucket_postings);
+    free(bucket_starts);
+}
+
+/* PIPELINE */
+
+typedef struct LoadTask {
+    pthread_t thread;
+    String file_name;
+    int sort_threads;
+    List * list;
+    // Time spent in each phase, for --bench
+    double read_seconds;
+    double sort_seconds;
+} LoadTask;
+
+typedef struct MergeTask {
+    pthread_t thread;
+    List * list_1;
+    List * list_2;
+    // Sorted binary rosters are merged straight from their mappings when these are set
+    Roster * roster_1;
+    Roster * roster_2;
+    Queue * queue;
+    // Departments are interned while merging when this is set
+    Interner * departments;
+    // Per-department GPA totals are accumulated while merging when this is set
+    Aggregates * aggregates;
+    // Records merged and time spent merging, for --bench
+    unsigned long count;
+    double seconds;
+} MergeTask;
+
+double now(){
+    struct timespec time;
+
+    clock_gettime(CLOCK_MONOTONIC, &time);
+
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+// Bytes currently allocated on the heap, including large mmap'd blocks
+unsigned long heap_bytes(){
+    struct mallinfo2 info = mallinfo2();
+
+    return info.uordblks + info.hblkhd;
+}
+
+// Reads and sorts one input
+void * load_worker(void * arg){
+    LoadTask * task = arg;
+    double start = now();
+
+    task->list = read_from(task->file_name);
+    task->read_seconds = now() - start;
+
+    start = now();
+    sort(task->list, task->sort_threads);
+    task->sort_seconds = now() - start;
+
+    return NULL;
+}
+
+// Hands one merged student to the writer, interning and aggregating it on the way
+void emit(MergeTask * task, Batch ** batch, Student * student){
+    Student * copy = &(*batch)->students[(*batch)->size++];
+
+    *copy = *student;
+
+    if (task->departments != NULL){
+        copy->department_id = intern(task->departments, copy->department);
+
+        if (task->aggregates != NULL){
+            add_to_aggregate(task->aggregates, copy->department_id, copy->gpa);
+        }
+    }
+
+    task->count++;
+
+    if ((*batch)->size == BATCH_SIZE){
+        push_to(task->queue, *batch);
+        *batch = create_batch();
+    }
+}
+
+// Merges two sorted mapped rosters without copying their names
+void merge_rosters(MergeTask * task, Batch ** batch){
+    Roster * roster_1 = task->roster_1;
+    Roster * roster_2 = task->roster_2;
+    uint64_t i = 0;
+    uint64_t j = 0;
+
+    while (i < roster_1->header->record_count || j < roster_2->header->record_count){
+        Roster * roster;
+        RosterRecord * record;
+
+        // Ties take roster_2 first, as the list merge does
+        if (j == roster_2->header->record_count
+            || (i < roster_1->header->record_count && roster_1->records[i].id < roster_2->records[j].id)){
+            roster = roster_1;
+            record = &roster_1->records[i++];
+        } else {
+            roster = roster_2;
+            record = &roster_2->records[j++];
+        }
+
+        Student student = {
+            .id = record->id,
+            .first_name = roster_string(roster, record->first_name),
+            .last_name = roster_string(roster, record->last_name),
+            .department = roster_string(roster, record->department),
+            .gpa = record->gpa
+        };
+
+        emit(task, batch, &student);
+    }
+}
+
+// Merges two sorted lists or rosters into batches of students for the writer
+void * merge_worker(void * arg){
+    MergeTask * task = arg;
+    double start = now();
+    Batch * batch = create_batch();
+
+    if (task->roster_1 != NULL){
+        merge_rosters(task, &batch);
+    } else {
+        Node * node_1 = task->list_1->head;
+        Node * node_2 = task->list_2->head;
+
+        while (node_1 != NULL || node_2 != NULL){
+            if (node_2 == NULL || (node_1 != NULL && node_1->student->id < node_2->student->id)){
+                emit(task, &batch, node_1->student);
+                node_1 = node_1->next;
+            } else {
+                emit(task, &batch, node_2->student);
+                node_2 = node_2->next;
+            }
+        }
+    }
+
+    if (batch->size > 0){
+        push_to(task->queue, batch);
+    } else {
+        free(batch);
+    }
+
+    close_queue(task->queue);
+    task->seconds = now() - start;
+
+    return NULL;
+}
+
+// Writes batches to file_name as they arrive until the queue is closed, recording each into index if set
+void write_from(String file_name, Queue * queue, Index * index){
+    FILE * file = fopen(file_name, "w+");
+
+    if (file != NULL){
+        Batch * batch;
+
+        setvbuf(file, NULL, _IOFBF, 1 << 20);
+
+        while ((batch = pop_from(queue)) != NULL){
+            for (int i = 0; i < batch->size; i++){
+                int length = write_student(file, &batch->students[i]);
+
+                if (length < 0){
+                    printf("ERROR: Couldn't write to %s\n", file_name);
+                    exit(-1);
+                }
+
+                if (index != NULL){
+                    add_entry(index, &batch->students[i], length);
+                }
+            }
+
+            free(batch);
+        }
+
+        // Buffered writes can still fail when flushed
+        if (ferror(file) || fclose(file) != 0){
+            printf("ERROR: Couldn't write to %s\n", file_name);
+            exit(-1);
+        }
+    } else {
+        printf("ERROR: Couldn't open %s for writing\n", file_name);
+        exit(-1);
+    }
+}
+
+// Binary counterpart of write_from; every distinct name is stored once
+void write_roster_from(String file_name, Queue * queue){
+    FILE * file = fopen(file_name, "w+");
+
+    if (file != NULL){
+        RosterHeader header = { .magic = ROSTER_MAGIC };
+        // The interner's strings become the roster's string table
+        Interner * names = create_interner();
+        Batch * batch;
+
+        setvbuf(file, NULL, _IOFBF, 1 << 20);
+
+        // Header is rewritten once the counts are known
+        fwrite(&header, sizeof(RosterHeader), 1, file);
+
+        while ((batch = pop_from(queue)) != NULL){
+            for (int i = 0; i < batch->size; i++){
+                Student * student = &batch->students[i];
+                RosterRecord record = { .id = student->id, .gpa = student->gpa };
+
+                // Each intern may move names->offsets, so look offsets up only after it returns
+                unsigned int first_name = intern(names, student->first_name);
+                record.first_name = names->offsets[first_name];
+
+                unsigned int last_name = intern(names, student->last_name);
+                record.last_name = names->offsets[last_name];
+
+                unsigned int department = intern(names, student->department);
+                record.department = names->offsets[department];
+
+                fwrite(&record, sizeof(RosterRecord), 1, file);
+                header.record_count++;
+            }
+
+            free(batch);
+        }
+
+        header.strings = sizeof(RosterHeader) + header.record_count * sizeof(RosterRecord);
+        header.strings_size = names->size;
+
+        fwrite(names->strings, 1, names->size, file);
+        fseek(file, 0, SEEK_SET);
+        fwrite(&header, sizeof(RosterHeader), 1, file);
+
+        if (ferror(file)){
+            printf("ERROR: Couldn't write binary roster %s\n", file_name);
+            exit(-1);
+        }
+
+        fclose(file);
+
+        destroy_interner(names);
+    } else {
+        printf("ERROR: Couldn't open %s for writing\n", file_name);
+        exit(-1);
+    }
+}
+
+int cpu_count(){
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return (count > 0) ? (int) count : 1;
+}
+
+/* QUERY */
+
+typedef struct IndexFile {
+    IndexHeader * header;
+    size_t size;
+    uint64_t * offsets;
+    uint32_t * ids;
+    uint32_t * eytzinger;
+    uint32_t * eytzinger_ranks;
+    IndexDepartment * departments;
+    uint32_t * department_postings;
+    uint32_t * buckets;
+    uint32_t * bucket_postings;
+    char * names;
+} IndexFile;
+
+// Returns 1 if count elements starting at byte start lie inside the index file
+int index_holds(IndexFile * index, uint64_t start, uint64_t count, size_t element){
+    return start <= index->size && count <= (index->size - start) / element;
+}
+
+// Maps an index file without reading it; only the pages a query touches are loaded
+IndexFile open_index(String file_name){
+    IndexFile index;
+    struct stat info;
+    int fd = open(file_name, O_RDONLY);
+
+    if (fd < 0 || fstat(fd, &info) != 0){
+        printf("ERROR: Index not found. %s does not exist\n", file_name);
+        exit(-1);
+    }
+
+    index.size = info.st_size;
+    index.header = mmap(NULL, index.size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (index.header == MAP_FAILED || index.size < sizeof(IndexHeader) || index.header->magic != INDEX_MAGIC){
+        printf("ERROR: %s is not an index file\n", file_name);
+        exit(-1);
+    }
+
+    char * base = (char *) index.header;
+
+    index.offsets = (uint64_t *) (base + index.header->offsets);
+    index.ids = (uint32_t *) (base + index.header->ids);
+    index.eytzinger = (uint32_t *) (base + index.header->eytzinger);
+    index.eytzinger_ranks = (uint32_t *) (base + index.header->eytzinger_ranks);
+    index.departments = (IndexDepartment *) (base + index.header->departments);
+    index.department_postings = (uint32_t *) (base + index.header->department_postings);
+    index.buckets = (uint32_t *) (base + index.header->buckets);
+    index.bucket_postings = (uint32_t *) (base + index.header->bucket_postings);
+    index.names = base + index.header->names;
+
+    // Reject truncated or corrupt files before any section is dereferenced
+    IndexHeader * header = index.header;
+    uint64_t count = header->record_count;
+    int valid = header->bucket_count == GPA_BUCKETS
+        && index_holds(&index, header->offsets, count + 1, sizeof(uint64_t))
+        && index_holds(&index, header->ids, count, sizeof(uint32_t))
+        && index_holds(&index, header->eytzinger, count + 1, sizeof(uint32_t))
+        && index_holds(&index, header->eytzinger_ranks, count + 1, sizeof(uint32_t))
+        && index_holds(&index, header->departments, header->department_count, sizeof(IndexDepartment))
+        && index_holds(&index, header->department_postings, count, sizeof(uint32_t))
+        && index_holds(&index, header->buckets, GPA_BUCKETS + 1, sizeof(uint32_t))
+        && index_holds(&index, header->bucket_postings, count, sizeof(uint32_t))
+        && header->names <= index.size
+        && (header->department_count == 0 || ((char *) header)[index.size - 1] == '\0');
+
+    for (uint32_t i = 0; valid && i < header->department_count; i++){
+        valid = index.departments[i].name < index.size - header->names
+            && index.departments[i].first <= count
+            && index.departments[i].count <= count - index.departments[i].first;
+    }
+
+    if (!valid){
+        printf("ERROR: %s is truncated or corrupt; rebuild it with --index\n", file_name);
+        exit(-1);
+    }
+
+    return index;
+}
+
+// Deletes a side file such as an index or summary left over from an earlier run, since it
+// would no longer describe the roster
+void remove_side_file(String file_name, String suffix){
+    String side_name = file_name_with(file_name, suffix);
+
+    if (unlink(side_name) != 0 && errno != ENOENT){
+        printf("ERROR: Couldn't remove stale %s\n", side_name);
+        exit(-1);
+    }
+
+    free(side_name);
+}
+
+// Roster position of the first record with an id >= id, or record_count if there is none
+uint32_t lower_bound(IndexFile * index, uint32_t id){
+    uint32_t count = index->header->record_count;
+    uint32_t k = 1;
+
+    while (k <= count){
+        k = 2 * k + (index->eytzinger[k] < id);
+    }
+
+    // Undo the right turns taken after the last left turn
+    k >>= __builtin_ffs(~k);
+
+    return index->eytzinger_ranks[k];
+}
+
+// Copies the record at a roster position to stdout
+void print_record(IndexFile * index, int roster, uint32_t rank){
+    char buffer[4096];
+
+    if (rank >= index->header->record_count){
+        printf("ERROR: Index points past its last record; rebuild it with --index\n");
+        exit(-1);
+    }
+
+    uint64_t offset = index->offsets[rank];
+    uint64_t end = index->offsets[rank + 1];
+
+    while (offset < end){
+        size_t length = (end - offset < sizeof(buffer)) ? end - offset : sizeof(buffer);
+        ssize_t got = pread(roster, buffer, length, offset);
+
+        if (got <= 0){
+            printf("ERROR: Roster is shorter than its index\n");
+            exit(-1);
+        }
+
+        fwrite(buffer, 1, got, stdout);
+        offset += got;
+    }
+}
+
+// Returns 1 if the GPA printed in the record at a roster position is within [min, max] hundredths
+int gpa_within(IndexFile * index, int roster, uint32_t rank, double min, double max){
+    uint64_t length = index->offsets[rank + 1] - index->offsets[rank];
+    String record = malloc(length + 1);
+
+    if (record == NULL){
+        printf("ERROR: Couldn't allocate memory for record\n");
+        exit(-1);
+    }
+
+    if (index->offsets[rank + 1] < index->offsets[rank]
+        || pread(roster, record, length, index->offsets[rank]) != (ssize_t) length){
+        printf("ERROR: Roster is shorter than its index\n");
+        exit(-1);
+    }
+
+    record[length] = '\0';
+
+    // GPA is the last field
+    String gpa = strrchr(record, ';');
+    double hundredths = (gpa != NULL) ? rint(strtod(gpa + 1, NULL) * 100) : NAN;
+    int within = hundredths >= min && hundredths <= max;
+
+    free(record);
+
+    return within;
+}
+
+// Prints a GPA bucket's records; records in the open-ended edge buckets are checked one by one
+void print_bucket(IndexFile * index, int roster, uint32_t bucket, double min, double max){
+    int check = (bucket == 0 || bucket == GPA_BUCKETS - 1);
+
+    for (uint32_t i = index->buckets[bucket]; i < index->buckets[bucket + 1] && i < index->header->record_count; i++){
+        uint32_t rank = index->bucket_postings[i];
+
+        if (rank >= index->header->record_count){
+            printf("ERROR: Index points past its last record; rebuild it with --index\n");
+            exit(-1);
+        }
+
+        if (!check || gpa_within(index, roster, rank, min, max)){
+            print_record(index, roster, rank);
+        }
+    }
+}
+
+int query(int argc, String argv[]){
+    // id takes one or two values, dept one and gpa two
+    int valid = (argc == 3 || argc == 4) && (strcmp(argv[1], "id") == 0
+        || (strcmp(argv[1], "dept") == 0 && argc == 3)
+        || (strcmp(argv[1], "gpa") == 0 && argc == 4));
+
+    if (!valid){
+        printf("Follow format: ./mergestudents --query output.txt id <id> [<max id>] | dept <department> | gpa <min> <max>\n");
+        return -1;
+    }
+
+    // Binary rosters are sorted fixed-width records, so id queries need no index
+    if (is_roster(argv[0])){
+        if (strcmp(argv[1], "id") != 0){
+            printf("ERROR: Binary rosters only support id queries\n");
+            exit(-1);
+        }
+
+        Roster roster = open_roster(argv[0]);
+        uint32_t min = strtoul(argv[2], NULL, 10);
+        uint32_t max = (argc > 3) ? strtoul(argv[3], NULL, 10) : min;
+
+        for (uint64_t i = find_in_roster(&roster, min);
+             i < roster.header->record_count && roster.records[i].id <= max; i++){
+            write_record(stdout, &roster, &roster.records[i]);
+        }
+
+        close_roster(&roster);
+
+        return 0;
+    }
+
+    String index_name = file_name_with(argv[0], INDEX_SUFFIX);
+    IndexFile index = open_index(index_name);
+    int roster = open(argv[0], O_RDONLY);
+    struct stat info;
+
+    if (roster < 0 || fstat(roster, &info) != 0){
+        printf("ERROR: File not found. %s does not exist\n", argv[0]);
+        exit(-1);
+    }
+
+    // The index records the roster's size, which catches a roster rewritten since
+    if (index.offsets[index.header->record_count] != (uint64_t) info.st_size){
+        printf("ERROR: %s does not match %s; rebuild it with --index\n", index_name, argv[0]);
+        exit(-1);
+    }
+
+    free(index_name);
+
+    if (strcmp(argv[1], "id") == 0){
+        uint32_t min = strtoul(argv[2], NULL, 10);
+        uint32_t max = (argc > 3) ? strtoul(argv[3], NULL, 10) : min;
+
+        for (uint32_t rank = lower_bound(&index, min);
+             rank < index.header->record_count && index.ids[rank] <= max; rank++){
+            print_record(&index, roster, rank);
+        }
+    } else if (strcmp(argv[1], "dept") == 0){
+        // Binary search the department table by name
+        uint32_t low = 0;
+        uint32_t high = index.header->department_count;
+
+        while (low < high){
+            uint32_t middle = low + (high - low) / 2;
+
+            if (strcmp(index.names + index.departments[middle].name, argv[2]) < 0){
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+
+        if (low < index.header->department_count && strcmp(index.names + index.departments[low].name, argv[2]) == 0){
+            IndexDepartment * department = &index.departments[low];
+
+            for (uint32_t i = 0; i < department->count; i++){
+                print_record(&index, roster, index.department_postings[department->first + i]);
+            }
+        }
+    } else {
+        // Buckets hold the GPA as printed, so whole hundredths bound the range exactly
+        double min = ceil(strtod(argv[2], NULL) * 100 - 1e-6);
+        double max = floor(strtod(argv[3], NULL) * 100 + 1e-6);
+
+        if (min < 0 && min <= max){
+            print_bucket(&index, roster, 0, min, max);
+        }
+
+        for (long hundredths = (min > 0) ? min : 0;
+             hundredths <= max && hundredths <= GPA_MAX_HUNDREDTHS; hundredths++){
+            print_bucket(&index, roster, hundredths + 1, min, max);
+        }
+
+        if (max > GPA_MAX_HUNDREDTHS && min <= max){
+            print_bucket(&index, roster, GPA_BUCKETS - 1, min, max);
+        }
+    }
+
+    close(roster);
+    munmap(index.header, index.size);
+
+    return 0;
+}
+
+/* DELTA */
+
+// Drops all but the last of each run of equal ids in a sorted list
+void remove_duplicates_from(List * list){
+    Node * node = list->head;
+
+    while (node != NULL && node->next != NULL){
+        Node * next = node->next;
+
+        if (node->student->id == next->student->id){
+            next->prev = node->prev;
+
+            if (node->prev != NULL){
+                node->prev->next = next;
+            } else {
+                list->head = next;
+            }
+
+            destroy_node(node);
+        }
+
+        node = next;
+    }
+}
+
+void fill_scanner(Scanner * scanner, uint64_t offset){
+    ssize_t got = pread(scanner->fd, scanner->buffer, SPARSE_BLOCK_SIZE, offset);
+
+    if (got < 0){
+        printf("ERROR: Couldn't read master roster\n");
+        exit(-1);
+    }
+
+    scanner->start = offset;
+    scanner->length = got;
+    scanner->buffer[got] = '\0';
+}
+
+// Stores the id of the record starting at offset and returns the offset just past it
+uint64_t scan_record(Scanner * scanner, uint64_t offset, unsigned int * id){
+    if (offset < scanner->start || offset >= scanner->start + scanner->length){
+        fill_scanner(scanner, offset);
+    }
+
+    char * line_end = memchr(scanner->buffer + (offset - scanner->start), '\n', scanner->start + scanner->length - offset);
+
+    if (line_end == NULL && scanner->start + scanner->length < scanner->size){
+        // Record runs past the buffer, so reload starting at it
+        fill_scanner(scanner, offset);
+        line_end = memchr(scanner->buffer, '\n', scanner->length);
+
+        if (line_end == NULL && scanner->length == SPARSE_BLOCK_SIZE){
+            printf("ERROR: Record at byte %lu of master roster is too long\n", (unsigned long) offset);
+            exit(-1);
+        }
+    }
+
+    *id = strtoul(scanner->buffer + (offset - scanner->start), NULL, 10);
+
+    return (line_end != NULL) ? scanner->start + (line_end - scanner->buffer) + 1 : scanner->size;
+}
+
+// Finds the first record starting at or after offset and stores its id; returns its offset, or the
+// roster size if there is none. Reads only a small probe, growing it while a record straddles its end.
+uint64_t sample_record(Scanner * scanner, uint64_t offset, unsigned int * id, char ** probe, size_t * capacity){
+    // A record starts at 0 or wherever the previous byte is a newline
+    uint64_t from = (offset > 0) ? offset - 1 : 0;
+
+    while (1){
+        ssize_t got = pread(scanner->fd, *probe, *capacity, from);
+
+        if (got < 0){
+            printf("ERROR: Couldn't read master roster\n");
+            exit(-1);
+        }
+
+        (*probe)[got] = '\0';
+
+        int at_end = (from + got >= scanner->size);
+        char * start = (offset == 0) ? *probe : memchr(*probe, '\n', got);
+
+        if (start != NULL && offset > 0){
+            start++;
+        }
+
+        if (start != NULL && (at_end || strpbrk(start, ";\n") != NULL)){
+            if (start == *probe + got){
+                return scanner->size;
+            }
+
+            *id = strtoul(start, NULL, 10);
+
+            return from + (start - *probe);
+        }
+
+        if (start == NULL && at_end){
+            return scanner->size;
+        }
+
+        *capacity *= 2;
+        *probe = realloc(*probe, *capacity + 1);
+
+        if (*probe == NULL){
+            printf("ERROR: Couldn't allocate memory for sparse index probe\n");
+            exit(-1);
+        }
+    }
+}
+
+// Samples the id at the first record of every block of the roster
+SparseIndex build_sparse_index(Scanner * scanner){
+    SparseIndex index;
+    unsigned int capacity = scanner->size / SPARSE_BLOCK_SIZE + 1;
+    size_t probe_capacity = SPARSE_PROBE_SIZE;
+    char * probe = malloc(probe_capacity + 1);
+
+    index.ids = malloc(capacity * sizeof(unsigned int));
+    index.offsets = malloc(capacity * sizeof(uint64_t));
+    index.count = 0;
+
+    if (index.ids == NULL || index.offsets == NULL || probe == NULL){
+        printf("ERROR: Couldn't allocate memory for sparse index\n");
+        exit(-1);
+    }
+
+    for (uint64_t block = 0; block < scanner->size; block += SPARSE_BLOCK_SIZE){
+        unsigned int id;
+        uint64_t start = sample_record(scanner, block, &id, &probe, &probe_capacity);
+
+        // Skip blocks that hold no record start of their own
+        if (start >= scanner->size || (index.count > 0 && start == index.offsets[index.count - 1])){
+            continue;
+        }
+
+        index.ids[index.count] = id;
+        index.offsets[index.count++] = start;
+    }
+
+    free(probe);
+
+    return index;
+}
+
+// Returns the offset of the first record at or after from whose id is >= id
+uint64_t find_insertion(SparseIndex * index, Scanner * scanner, uint64_t from, unsigned int id){
+    // Binary search for the last sample with a smaller id
+    unsigned int low = 0;
+    unsigned int high = index->count;
+
+    while (low < high){
+        unsigned int middle = low + (high - low) / 2;
+
+        if (index->ids[middle] < id){
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    uint64_t offset = (low > 0 && index->offsets[low - 1] > from) ? index->offsets[low - 1] : from;
+
+    // Scan forward from there
+    while (offset < scanner->size){
+        unsigned int record_id;
+        uint64_t end = scan_record(scanner, offset, &record_id);
+
+        if (record_id >= id){
+            break;
+        }
+
+        offset = end;
+    }
+
+    return offset;
+}
+
+// Copies [offset, end) of in to the current position of out without going through user space
+void copy_range(int in, int out, uint64_t offset, uint64_t end){
+    while (offset < end){
+        loff_t in_offset = offset;
+        ssize_t copied = copy_file_range(in, &in_offset, out, NULL, end - offset, 0);
+
+        if (copied < 0 && (errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP || errno == EINVAL)){
+            off_t sendfile_offset = offset;
+            copied = sendfile(out, in, &sendfile_offset, end - offset);
+        }
+
+        if (copied <= 0){
+            printf("ERROR: Couldn't copy master roster to output\n");
+            exit(-1);
+        }
+
+        offset += copied;
+    }
+}
+
+// Merges a small unsorted delta into a sorted master roster; delta records replace master records with the same id
+void merge_delta(String master_file, String delta_file, String output_file){
+    Scanner * scanner = malloc(sizeof(Scanner));
+    struct stat master_info, output_info;
+
+    if (scanner == NULL){
+        printf("ERROR: Couldn't allocate memory for scanner\n");
+        exit(-1);
+    }
+
+    scanner->fd = open(master_file, O_RDONLY);
+
+    if (scanner->fd < 0 || fstat(scanner->fd, &master_info) != 0){
+        printf("ERROR: File not found. %s does not exist\n", master_file);
+        exit(-1);
+    }
+
+    if (stat(output_file, &output_info) == 0 && output_info.st_dev == master_info.st_dev && output_info.st_ino == master_info.st_ino){
+        printf("ERROR: Output file can't be the master roster\n");
+        exit(-1);
+    }
+
+    scanner->size = master_info.st_size;
+    scanner->start = 0;
+    scanner->length = 0;
+
+    List * delta = read_from(delta_file);
+
+    sort(delta, cpu_count());
+    remove_duplicates_from(delta);
+
+    SparseIndex index = build_sparse_index(scanner);
+
+    int out = open(output_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    FILE * file = (out >= 0) ? fdopen(out, "w") : NULL;
+
+    if (file == NULL){
+        printf("ERROR: Couldn't open %s for writing\n", output_file);
+        exit(-1);
+    }
+
+    // Everything before cursor in the master roster has been handled
+    uint64_t cursor = 0;
+    char last_byte = '\n';
+
+    if (scanner->size > 0 && pread(scanner->fd, &last_byte, 1, scanner->size - 1) != 1){
+        printf("ERROR: Couldn't read master roster\n");
+        exit(-1);
+    }
+
+    int terminated = (last_byte == '\n');
+
+    for (Node * node = delta->head; node != NULL; node = node->next){
+        unsigned int id = node->student->id;
+        uint64_t offset = find_insertion(&index, scanner, cursor, id);
+
+        // Untouched master records go straight across; buffered delta records must land first
+        if (offset > cursor){
+            fflush(file);
+            copy_range(scanner->fd, out, cursor, offset);
+
+            // The master's last record may lack its newline
+            if (offset == scanner->size && !terminated){
+                fputc('\n', file);
+            }
+        }
+
+        write_student(file, node->student);
+
+        // Skip the master records this one replaces
+        while (offset < scanner->size){
+            unsigned int record_id;
+            uint64_t end = scan_record(scanner, offset, &record_id);
+
+            if (record_id != id){
+                break;
+            }
+
+            offset = end;
+        }
+
+        cursor = offset;
+    }
+
+    fflush(file);
+    copy_range(scanner->fd, out, cursor, scanner->size);
+
+    fclose(file);
+    close(scanner->fd);
+
+    free(index.ids);
+    free(index.offsets);
+    free(scanner);
+    destroy_list(delta);
+}
+
+/* MAIN */
+
+int main(int argc, String argv[]){
+    int rc = 0;
+    int build_index = 0;
+    int build_stats = 0;
+    int delta = 0;
+    int binary = 0;
+    int bench = 0;
+    int arg = 1;
+
+    if (argc > 1 && strcmp(argv[1], "--query") == 0){
+        return query(argc - 2, argv + 2);
+    }
+
+    // Options come before the file names
+    while (arg < argc && strncmp(argv[arg], "--", 2) == 0){
+        if (strcmp(argv[arg], "--index") == 0){
+            build_index = 1;
+        } else if (strcmp(argv[arg], "--stats") == 0){
+            build_stats = 1;
+        } else if (strcmp(argv[arg], "--delta") == 0){
+            delta = 1;
+        } else if (strcmp(argv[arg], "--binary") == 0){
+            binary = 1;
+        } else if (strcmp(argv[arg], "--bench") == 0){
+            bench = 1;
+        } else {
+            printf("Unknown option %s\n", argv[arg]);
+            return -1;
+        }
+
+        arg++;
+    }
+
+    if (delta && argc - arg == 3){
+        if (build_index || build_stats || bench){
+            printf("ERROR: --index, --stats and --bench need a full merge and can't be used with --delta\n");
+            return -1;
+        }
+
+        if (binary || is_roster(argv[arg])){
+            printf("ERROR: --delta only works on text rosters\n");
+            return -1;
+        }
+
+        merge_delta(argv[arg], argv[arg + 1], argv[arg + 2]);
+        remove_side_file(argv[arg + 2], INDEX_SUFFIX);
+        remove_side_file(argv[arg + 2], STATS_SUFFIX);
+    } else if (build_index && binary){
+        printf("ERROR: Binary rosters are searchable as they are and can't take --index\n");
+        return -1;
+    } else if (argc - arg == 3){
+        // Get file names from command line arguments
+        String input_file_1 = strdup(argv[arg]);
+        String input_file_2 = strdup(argv[arg + 1]);
+        String output_file = strdup(argv[arg + 2]);
+
+        // Both inputs sort at once, so each gets half of the cores
+        int sort_threads = cpu_count() / 2;
+
+        if (sort_threads < 1){
+            sort_threads = 1;
+        }
+
+        double start = now();
+
+        LoadTask load_1 = { .file_name = input_file_1, .sort_threads = sort_threads };
+        LoadTask load_2 = { .file_name = input_file_2, .sort_threads = sort_threads };
+        Roster roster_1, roster_2;
+
+        // Two sorted binary rosters are merged where they are mapped, with no lists built
+        int mapped = is_roster(input_file_1) && is_roster(input_file_2);
+
+        if (mapped){
+            roster_1 = open_roster(input_file_1);
+            roster_2 = open_roster(input_file_2);
+            mapped = roster_is_sorted(&roster_1) && roster_is_sorted(&roster_2);
+
+            if (!mapped){
+                close_roster(&roster_1);
+                close_roster(&roster_2);
+            }
+        }
+
+        if (!mapped){
+            // Read and sort both files concurrently
+            start_thread(&load_1.thread, load_worker, &load_1);
+            start_thread(&load_2.thread, load_worker, &load_2);
+
+            pthread_join(load_1.thread, NULL);
+            pthread_join(load_2.thread, NULL);
+        }
+
+        free(input_file_1);
+        free(input_file_2);
+
+        double load_seconds = now() - start;
+        unsigned long loaded_heap_bytes = heap_bytes();
+
+        // Merge on a worker while this thread writes the output
+        MergeTask merge_task = { .list_1 = load_1.list, .list_2 = load_2.list, .queue = create_queue() };
+
+        if (mapped){
+            merge_task.roster_1 = &roster_1;
+            merge_task.roster_2 = &roster_2;
+        }
+        Index * index = NULL;
+
+        if (build_index || build_stats){
+            merge_task.departments = create_interner();
+        }
+
+        if (build_index){
+            index = create_index();
+        } else {
+            remove_side_file(output_file, INDEX_SUFFIX);
+        }
+
+        if (build_stats){
+            merge_task.aggregates = create_aggregates();
+        } else {
+            remove_side_file(output_file, STATS_SUFFIX);
+        }
+
+        double write_start = now();
+
+        start_thread(&merge_task.thread, merge_worker, &merge_task);
+
+        if (binary){
+            write_roster_from(output_file, merge_task.queue);
+        } else {
+            write_from(output_file, merge_task.queue, index);
+        }
+
+        pthread_join(merge_task.thread, NULL);
+
+        double write_seconds = now() - write_start;
+        unsigned long written_heap_bytes = heap_bytes();
+        double side_start = now();
+
+        if (build_index){
+            String index_file = file_name_with(output_file, INDEX_SUFFIX);
+
+            write_index(index_file, index, merge_task.departments);
+
+            free(index_file);
+            destroy_index(index);
+        }
+
+        if (build_stats){
+            String stats_file = file_name_with(output_file, STATS_SUFFIX);
+
+            write_aggregates(stats_file, merge_task.aggregates, merge_task.departments);
+
+            free(stats_file);
+            destroy_aggregates(merge_task.aggregates);
+        }
+
+        if (merge_task.departments != NULL){
+            destroy_interner(merge_task.departments);
+        }
+
+        if (bench){
+            struct rusage usage;
+
+            getrusage(RUSAGE_SELF, &usage);
+
+            // Phases on different threads overlap, so they don't sum to the total
+            printf("{\"threads\": %d, \"records\": %lu, "
+                   "\"read_seconds\": [%.6f, %.6f], \"sort_seconds\": [%.6f, %.6f], \"load_seconds\": %.6f, "
+                   "\"merge_seconds\": %.6f, \"write_seconds\": %.6f, \"side_files_seconds\": %.6f, \"total_seconds\": %.6f, "
+                   "\"loaded_heap_bytes\": %lu, \"written_heap_bytes\": %lu, \"peak_rss_kb\": %ld}\n",
+                cpu_count(), merge_task.count,
+                load_1.read_seconds, load_2.read_seconds, load_1.sort_seconds, load_2.sort_seconds, load_seconds,
+                merge_task.seconds, write_seconds, now() - side_start, now() - start,
+                loaded_heap_bytes, written_heap_bytes, usage.ru_maxrss);
+        }
+
+        free(output_file);
+
+        // Free memory
+        destroy_queue(merge_task.queue);
+
+        if (mapped){
+            close_roster(&roster_1);
+            close_roster(&roster_2);
+        } else {
+            destroy_list(load_1.list);
+            destroy_list(load_2.list);
+        }
     } else {
-        printf("Invalid arguments given: %d arguments.\nFollow format: ./mergestudents input1.txt input2.txt output.txt\n", argc);
+        printf("Invalid arguments given: %d arguments.\nFollow format: ./mergestudents [--index] [--stats] [--binary] [--bench] input1.txt input2.txt output.txt\n"
+               "          or: ./mergestudents --delta master.txt delta.txt output.txt\n"
+               "          or: ./mergestudents --query output.txt id <id> [<max id>] | dept <department> | gpa <min> <max>\n", argc);
         
         rc = -1;
     }